@@ -11,6 +11,10 @@
   Modified 2019 Nick Hale
  */
 
+/* large file offsets and POSIX fsync/fileno/fseeko under -std=c99 */
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -20,8 +24,17 @@
 #include <getopt.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <math.h>
+#include <float.h>
 #include "rescale.h"
 #include <errno.h>
+#ifdef WINDOWS
+#include <io.h>
+#endif
+#ifdef INOTIFY
+#include <sys/inotify.h>
+#include <dirent.h>
+#endif
 
 
 /*
@@ -66,7 +79,22 @@ void usage()
   printf("\tDefault value is %d\n", DEFAULT_HISTOGRAM_BINS);
   printf(" -a\t*NEW* Sets output name to Auto - this looks for the corresponding .vgi file in the\n");
   printf("\tsame directory as the .vol and try to extract the size of the volume and append to the\n");
-  printf("\toutput filename.");
+  printf("\toutput filename.\n");
+  printf(" -j STR\tSets the journal file to STR. The journal records the scaling parameters and the\n");
+  printf("\tprogress of each output file so that an interrupted run can be resumed.\n");
+  printf("\tDefault value is the name of the first output file with %s appended\n", JOURNAL_SUFFIX);
+  printf(" -r, --resume\n");
+  printf("\tResumes an interrupted run from its journal. The inputs and options must match those\n");
+  printf("\tof the original run; finished outputs are skipped and partial ones are continued.\n");
+  printf(" -p STR\tSets the scaling policy to STR, one of global, file or both. global scales every\n");
+  printf("\tfile against the range across all of the inputs; file scales every file against its\n");
+  printf("\town range; both writes both, with %s before the suffix of the individually\n", PERFILE_TAG);
+  printf("\tscaled outputs. Both come from the same read passes. Default value is global\n");
+  printf(" -w DIR\tWatches DIR and converts volumes as they arrive, rather than converting input\n");
+  printf("\tfiles. Data files are read as they are written; once a .vgi file appears, all of\n");
+  printf("\tthe data files written since the last one are converted together. Cannot be\n");
+  printf("\tcombined with -r or -j.\n");
+  printf(" -x STR\tSets the extension of data files picked up by -w to STR. Default value is %s\n", WATCH_EXTENSION);
 #ifdef UINT16
   printf("Please note that the %s version will not consider values\n", RESCALE_DTYPE);
   printf("of 0 or 65535 in the scaling - these are known saturated values\n");
@@ -88,6 +116,45 @@ int64_t get_filesize(const char *filename)
   return -1;
 }
 
+int64_t get_filemtime(const char *filename)
+{
+#ifdef WINDOWS
+  struct __stat64 st;
+  if (_stat64(filename, &st) == 0)
+#else
+  struct stat st;
+  if (stat(filename, &st) == 0)
+#endif
+    {
+      return (int64_t)st.st_mtime;
+    }
+  return -1;
+}
+
+/* flush a stream all the way down to the disk */
+int sync_file(FILE *file)
+{
+  if (fflush(file) != 0)
+    {
+      return -1;
+    }
+#ifdef WINDOWS
+  return _commit(_fileno(file));
+#else
+  return fsync(fileno(file));
+#endif
+}
+
+/* seek to an absolute byte offset which may well be beyond 2 GiB */
+int seek_file(FILE *file, uint64_t offset)
+{
+#ifdef WINDOWS
+  return _fseeki64(file, (__int64)offset, SEEK_SET);
+#else
+  return fseeko(file, (off_t)offset, SEEK_SET);
+#endif
+}
+
 
 int read_first_value(char *filename, raw_t *target)
 {
@@ -137,11 +204,18 @@ int read_first_value(char *filename, raw_t *target)
 }
 
 
-uint64_t find_minmax_values(char *filename, raw_t *minval, raw_t *maxval, uint64_t total_size_read, uint64_t total_size_input, uint64_t bufcount, raw_t *buffer, time_t clk_split)
+uint64_t find_minmax_values(char *filename, raw_t *minval, raw_t *maxval, raw_t *file_minval, raw_t *file_maxval, uint64_t total_size_read, uint64_t total_size_input, uint64_t bufcount, raw_t *buffer, time_t clk_split)
 {
   FILE *infile;
   uint64_t u;
   size_t read_elements;
+  int first_block;
+
+  /* track this file on its own and fold it into the collective extents
+     at the end; an empty file simply inherits the collective ones */
+  *file_minval = *minval;
+  *file_maxval = *maxval;
+  first_block = 1;
 
   printf("Working on file %s\n", filename);
   //printf("minval is %d\n", *minval);
@@ -154,6 +228,12 @@ uint64_t find_minmax_values(char *filename, raw_t *minval, raw_t *maxval, uint64
       //	printf("fread done\n");
       total_size_read += read_elements * sizeof(raw_t);
       //	printf("inc done\n");
+      if (first_block == 1 && read_elements > 0)
+	{
+	  *file_minval = buffer[0];
+	  *file_maxval = buffer[0];
+	  first_block = 0;
+	}
 
       printf("Read %" PRIu64 " bytes of %" PRIu64 " (%0.3f of %0.3f GiB, (%0.3f MiB/s), %0.2f%%)",
 		 total_size_read,
@@ -172,26 +252,44 @@ uint64_t find_minmax_values(char *filename, raw_t *minval, raw_t *maxval, uint64
       for (u=0; u<read_elements;u++)
 	{
 	  // printf("min and max at %u and %u\n", *minval, *maxval);
-	  if (buffer[u] < *minval) { *minval = buffer[u]; }
-	  if (buffer[u] > *maxval) { *maxval = buffer[u]; }
+	  if (buffer[u] < *file_minval) { *file_minval = buffer[u]; }
+	  if (buffer[u] > *file_maxval) { *file_maxval = buffer[u]; }
 	}
       //printf("outloop\n");
-      printf(" - min/max values now %0.4f / %0.4f\r", (float)*minval, (float)*maxval);
+      printf(" - min/max values now %0.4f / %0.4f\r", (float)*file_minval, (float)*file_maxval);
     }
 
+  if (*file_minval < *minval) { *minval = *file_minval; }
+  if (*file_maxval > *maxval) { *maxval = *file_maxval; }
+
   fclose(infile);
   printf("\n");
   return total_size_read;
 }
 
-uint64_t build_histogram(char *filename, uint64_t *histogram, raw_t minval, float bin_factor, uint64_t total_size_read, uint64_t total_size_input, uint64_t bufcount, raw_t *buffer, time_t clk_split)
+/* histogram bin for a value, kept within [0, nbins] even if the value
+   falls outside the extents the bin factor was worked out from */
+int histogram_bin(raw_t value, raw_t minval, float bin_factor, int nbins)
+{
+  float bin;
+  bin = bin_factor * (value - minval);
+  if (!(bin > 0)) { return 0; }
+  if (bin > nbins) { return nbins; }
+  return (int)bin;
+}
+
+uint64_t build_histogram(char *filename, uint64_t *histogram, int nbins, raw_t minval, float bin_factor, uint64_t *file_histogram, raw_t file_minval, float file_bin_factor, raw_t *seen_minval, raw_t *seen_maxval, uint64_t total_size_read, uint64_t total_size_input, uint64_t bufcount, raw_t *buffer, time_t clk_split)
 {
   FILE *infile;
   uint64_t u;
   size_t read_elements;
-  int bin;
   infile = fopen(filename, "rb");
   printf("Working on file %s\n", filename);
+  if (infile == NULL)
+    {
+      printf("Error opening file %s\n", filename);
+      return total_size_read;
+    }
 
   while(!feof(infile))
     {
@@ -205,17 +303,33 @@ uint64_t build_histogram(char *filename, uint64_t *histogram, raw_t minval, floa
 	     ((float)total_size_read / MEBI) / (time(NULL)-clk_split),
 	     100*(float)total_size_read / (float)total_size_input);
 
+      /* widen the caller's extents with what is actually in the file,
+	 for callers which cannot be sure they saw all of it first time */
+      if (seen_minval != NULL)
+	{
+	  for (u = 0; u < read_elements; u++)
+	    {
+	      if (buffer[u] < *seen_minval) { *seen_minval = buffer[u]; }
+	      if (buffer[u] > *seen_maxval) { *seen_maxval = buffer[u]; }
+	    }
+	}
+
       for (u = 0; u < read_elements; u++)
 	{
 #ifdef UINT16
 	  /* do not count values of exactly zero for this; skew on Versa reconstructor */
 	  if (buffer[u] == 0 || buffer[u] == 65535 ) { continue; }
 #endif
-	  bin = (int)(bin_factor * (buffer[u] - minval));
+	  histogram[histogram_bin(buffer[u], minval, bin_factor, nbins)]++;
 
-	  histogram[bin]++;
+	  /* per-file histogram from the same read, if anyone wants it */
+	  if (file_histogram != NULL)
+	    {
+	      file_histogram[histogram_bin(buffer[u], file_minval, file_bin_factor, nbins)]++;
+	    }
 	}
     }
+  fclose(infile);
   printf("\n");
   return total_size_read;
 }
@@ -232,16 +346,154 @@ uint64_t calculate_number_of_values(uint64_t *histogram, int nbins)
   return nvals;
 }
 
-void convert_data(char *input_file, char *output_file, raw_t *inbuffer, unsigned char *outbuffer, float lowval, float scalerange, uint64_t buffer_count, uint64_t *total_size_read,  uint64_t *total_size_written,  uint64_t total_size_input)
+/* walk the histogram to find the values at the low and high percentiles */
+void find_percentile_extents(uint64_t *histogram, int nbins, raw_t minval, raw_t maxval, float t_low, float t_high, raw_t *lowval, raw_t *highval)
 {
-  uint64_t u;
+  uint64_t nvals;
+  float pvals, binsize;
+  int i;
+
+  nvals = calculate_number_of_values(histogram, nbins);
+  binsize = (maxval - minval) / (float)nbins;
+  pvals = 0.0;
+
+  /* assign these to sensible defaults in case t_low/high is set silly */
+  *lowval = minval;
+  *highval = maxval;
+
+  for (i=0; i<nbins; i++)
+    {
+      pvals += (float)histogram[i] / (float)nvals;
+      if (pvals < t_low) { *lowval = (i * binsize) + minval; }
+      if (pvals <= t_high) { *highval = (i*binsize) + minval; }
+    }
+}
+
+/* scale a buffer of raw values into bytes; with no range to scale
+   against (e.g. a blank slice of one single value) everything at or
+   below lowval becomes 0 and anything above it 255 */
+void scale_buffer(raw_t *inbuffer, unsigned char *outbuffer, size_t nelements, float lowval, float scalerange)
+{
+  size_t u;
   int val;
-  FILE *infile, *outfile;
+  if (!(scalerange > 0))
+    {
+      for (u = 0; u < nelements; u++)
+	{
+	  outbuffer[u] = (inbuffer[u] > lowval) ? 255 : 0;
+	}
+      return;
+    }
+  for (u = 0; u < nelements; u++)
+    {
+      val = (signed int)(255*((inbuffer[u] - lowval)/scalerange));
+      // sanity check and truncate for byte
+      if (val < 0) { val = 0; }
+      else if (val > 255) { val = 255; }
+      outbuffer[u] = (unsigned char)val;
+    }
+}
+
+/* opens an output for writing, or for continuing from an element offset */
+FILE *open_output(char *output_file, uint64_t start)
+{
+  FILE *outfile;
+  if (start == 0)
+    {
+      outfile = fopen(output_file, "wb");
+    }
+  else
+    {
+      /* anything beyond the committed offset is simply overwritten, and
+	 the finished output can never be longer than this, so there is
+	 no need to truncate */
+      outfile = fopen(output_file, "r+b");
+      if (outfile != NULL && seek_file(outfile, start * sizeof(unsigned char)) != 0)
+	{
+	  fclose(outfile);
+	  outfile = NULL;
+	}
+    }
+  if (outfile == NULL)
+    {
+      printf("Unable to open %s for writing\n", output_file);
+    }
+  return outfile;
+}
+
+/* output name is the input name, then the tag (may be empty), then the suffix */
+char *make_output_name(const char *input_file, const char *tag, const char *suffix)
+{
+  char *output_name;
+  size_t len;
+  len = 1+strlen(input_file)+strlen(tag)+strlen(suffix);
+  output_name = (char *)malloc(sizeof(char) * len);
+  snprintf(output_name, sizeof(char)*len, "%s%s%s", input_file, tag, suffix);
+  return output_name;
+}
+
+/* commits converted elements to the journal: the outputs must reach
+   the disk before the journal claims they have, otherwise a crash could
+   leave a hole. Only failing to sync an output is an error; the journal
+   is a convenience, so if it cannot be written we say so and carry on
+   without it */
+int commit_journal(journal_t *journal, int file_index, uint64_t elements, FILE *outfile, FILE *perfile_outfile)
+{
+  if (journal == NULL || journal->enabled == 0 || elements == 0)
+    {
+      return OK;
+    }
+  if ((outfile != NULL && sync_file(outfile) != 0)
+      || (perfile_outfile != NULL && sync_file(perfile_outfile) != 0))
+    {
+      printf("\nError syncing output of %s to disk\n", journal->input_files[file_index]);
+      return ERR_FAILED_TO_WRITE_OUTPUT;
+    }
+  journal->committed[file_index] += elements;
+  if (write_journal(journal) != OK)
+    {
+      printf("Warning: carrying on without the journal %s; this run cannot be resumed\n", journal->filename);
+      journal->enabled = 0;
+    }
+  return OK;
+}
+
+/* scales one input against the collective range into output_file and
+   against its own range into perfile_output_file, from a single read;
+   either output may be NULL if that scaling is not wanted */
+int convert_data(char *input_file, char *output_file, char *perfile_output_file, raw_t *inbuffer, unsigned char *outbuffer, float lowval, float scalerange, float perfile_lowval, float perfile_scalerange, uint64_t buffer_count, uint64_t *total_size_read,  uint64_t *total_size_written,  uint64_t total_size_input, raw_t *seen_minval, raw_t *seen_maxval, journal_t *journal, int file_index)
+{
+  uint64_t start; /* element to start from; non-zero when resuming a partial output */
+  uint64_t uncommitted; /* elements written since the journal was last committed */
+  FILE *infile, *outfile, *perfile_outfile;
+  size_t read_elements, u;
+  int status;
+
+  start = (journal != NULL) ? journal->committed[file_index] : 0;
+  uncommitted = 0;
+  outfile = NULL;
+  perfile_outfile = NULL;
+  status = OK;
   infile = fopen(input_file, "rb");
-  outfile = fopen(output_file, "wb");
-  size_t read_elements;
+  if (infile == NULL || seek_file(infile, start * sizeof(raw_t)) != 0)
+    {
+      printf("Unable to read %s from element %" PRIu64 "\n", input_file, start);
+      if (infile != NULL) { fclose(infile); }
+      return ERR_FAILED_TO_OPEN_THE_FILE_DESPITE_EVERYTHING_ELSE;
+    }
+  if ((output_file != NULL && (outfile = open_output(output_file, start)) == NULL)
+      || (perfile_output_file != NULL && (perfile_outfile = open_output(perfile_output_file, start)) == NULL))
+    {
+      status = ERR_FAILED_TO_WRITE_OUTPUT;
+    }
+  if (status == OK && start > 0)
+    {
+      printf("Continuing %s from element %" PRIu64 "\n", input_file, start);
+      *total_size_read += start * sizeof(raw_t);
+      *total_size_written += start * sizeof(unsigned char) * ((outfile != NULL) + (perfile_outfile != NULL));
+    }
 
-  while(!feof(infile))
+  while(status == OK && !feof(infile))
     {
       read_elements = fread(inbuffer, sizeof(raw_t), buffer_count, infile);
       *total_size_read += sizeof(raw_t)*read_elements;
@@ -251,22 +503,314 @@ void convert_data(char *input_file, char *output_file, raw_t *inbuffer, unsigned
 	     (float)(*total_size_read)/GIBI,
 	     (float)(total_size_input)/GIBI,
 	     100*((float)(*total_size_read)) / (float)total_size_input );
-      for (u = 0; u < read_elements; u++)
+
+      /* widen the caller's extents with what is actually in the file,
+	 for callers which cannot be sure they saw all of it first time */
+      if (seen_minval != NULL)
 	{
-	  val = (signed int)(255*((inbuffer[u] - lowval)/scalerange));
-	  // sanity check and truncate for byte
-	  if (val < 0) { val = 0; }
-	  else if (val > 255) { val = 255; }
-	  outbuffer[u] = (unsigned char)val;
+	  for (u = 0; u < read_elements; u++)
+	    {
+	      if (inbuffer[u] < *seen_minval) { *seen_minval = inbuffer[u]; }
+	      if (inbuffer[u] > *seen_maxval) { *seen_maxval = inbuffer[u]; }
+	    }
 	}
 
-      *total_size_written += read_elements * sizeof(unsigned char);
-      fwrite(outbuffer, sizeof(unsigned char), read_elements, outfile);
+      /* both scalings go through the one output buffer in turn, so
+	 the memory footprint stays the same whichever are wanted */
+      if (outfile != NULL)
+	{
+	  scale_buffer(inbuffer, outbuffer, read_elements, lowval, scalerange);
+	  *total_size_written += read_elements * sizeof(unsigned char);
+	  if (fwrite(outbuffer, sizeof(unsigned char), read_elements, outfile) != read_elements)
+	    {
+	      printf("\nError writing to %s\n", output_file);
+	      status = ERR_FAILED_TO_WRITE_OUTPUT;
+	      break;
+	    }
+	}
+      if (perfile_outfile != NULL)
+	{
+	  scale_buffer(inbuffer, outbuffer, read_elements, perfile_lowval, perfile_scalerange);
+	  *total_size_written += read_elements * sizeof(unsigned char);
+	  if (fwrite(outbuffer, sizeof(unsigned char), read_elements, perfile_outfile) != read_elements)
+	    {
+	      printf("\nError writing to %s\n", perfile_output_file);
+	      status = ERR_FAILED_TO_WRITE_OUTPUT;
+	      break;
+	    }
+	}
       printf(" - written %" PRIu64 " bytes (%0.3f GiB)\r", *total_size_written, (float)*total_size_written / GIBI);
+
+      /* syncing is slow, so only commit every JOURNAL_COMMIT_BYTES of input */
+      uncommitted += read_elements;
+      if (uncommitted * sizeof(raw_t) >= JOURNAL_COMMIT_BYTES)
+	{
+	  status = commit_journal(journal, file_index, uncommitted, outfile, perfile_outfile);
+	  uncommitted = 0;
+	}
+    }
+  if (status == OK)
+    {
+      status = commit_journal(journal, file_index, uncommitted, outfile, perfile_outfile);
     }
   printf("\n");
-  fclose(outfile);
+  if (perfile_outfile != NULL) { fclose(perfile_outfile); }
+  if (outfile != NULL) { fclose(outfile); }
   fclose(infile);
+  return status;
+}
+
+int init_journal(journal_t *journal, const char *filename, int num_files)
+{
+  journal->filename = malloc(sizeof(char) * (1+strlen(filename)));
+  strcpy(journal->filename, filename);
+  journal->threshold = 0.0;
+  journal->nbins = 0;
+  journal->lowval = 0.0;
+  journal->scalerange = 0.0;
+  journal->policy = SCALE_GLOBAL;
+  journal->enabled = 1;
+  journal->num_files = num_files;
+  journal->input_files = calloc(num_files, sizeof(char *));
+  journal->input_sizes = calloc(num_files, sizeof(int64_t));
+  journal->input_mtimes = calloc(num_files, sizeof(int64_t));
+  journal->committed = calloc(num_files, sizeof(uint64_t));
+  journal->file_lowvals = calloc(num_files, sizeof(float));
+  journal->file_scaleranges = calloc(num_files, sizeof(float));
+  if (journal->input_files == NULL || journal->input_sizes == NULL || journal->input_mtimes == NULL || journal->committed == NULL
+      || journal->file_lowvals == NULL || journal->file_scaleranges == NULL)
+    {
+      return ERR_STUPID_CONSTRAINTS;
+    }
+  return OK;
+}
+
+void free_journal(journal_t *journal)
+{
+  int i;
+  for (i = 0; i < journal->num_files; i++)
+    {
+      free(journal->input_files[i]);
+    }
+  free(journal->input_files);
+  free(journal->input_sizes);
+  free(journal->input_mtimes);
+  free(journal->committed);
+  free(journal->file_lowvals);
+  free(journal->file_scaleranges);
+  free(journal->filename);
+}
+
+/* write the journal out in full to a temporary file and rename it
+   over the old one, so that there is always one complete journal on
+   disk whenever we happen to die */
+int write_journal(journal_t *journal)
+{
+  FILE *jfile;
+  char *tmpname;
+  int i;
+
+  /* a unique temporary name, so that runs sharing a directory (or even
+     a journal) never trip over each other's half-written journals */
+  tmpname = malloc(sizeof(char) * (8+strlen(journal->filename)));
+  sprintf(tmpname, "%s.XXXXXX", journal->filename);
+#ifdef WINDOWS
+  jfile = (_mktemp(tmpname) == NULL) ? NULL : fopen(tmpname, "wb");
+#else
+  i = mkstemp(tmpname);
+  jfile = (i == -1) ? NULL : fdopen(i, "wb");
+#endif
+  if (jfile == NULL)
+    {
+      printf("\nError opening journal file %s for writing\n", tmpname);
+      free(tmpname);
+      return ERR_JOURNAL_UNWRITABLE;
+    }
+
+  /* floats go out in hex so they come back bit-for-bit */
+  fprintf(jfile, "%s %d\n", JOURNAL_MAGIC, JOURNAL_VERSION);
+  fprintf(jfile, "dtype %s\n", RESCALE_DTYPE);
+  fprintf(jfile, "threshold %a\n", journal->threshold);
+  fprintf(jfile, "bins %d\n", journal->nbins);
+  fprintf(jfile, "lowval %a\n", journal->lowval);
+  fprintf(jfile, "scalerange %a\n", journal->scalerange);
+  fprintf(jfile, "policy %d\n", journal->policy);
+  fprintf(jfile, "files %d\n", journal->num_files);
+  for (i = 0; i < journal->num_files; i++)
+    {
+      /* the name goes last as it may contain spaces */
+      fprintf(jfile, "file %" PRId64 " %" PRId64 " %" PRIu64 " %a %a %s\n",
+	      journal->input_sizes[i],
+	      journal->input_mtimes[i],
+	      journal->committed[i],
+	      journal->file_lowvals[i],
+	      journal->file_scaleranges[i],
+	      journal->input_files[i]);
+    }
+
+  if (ferror(jfile) || sync_file(jfile) != 0)
+    {
+      printf("\nError writing journal file %s\n", tmpname);
+      fclose(jfile);
+      remove(tmpname);
+      free(tmpname);
+      return ERR_JOURNAL_UNWRITABLE;
+    }
+  fclose(jfile);
+
+#ifdef WINDOWS
+  /* rename will not replace an existing file here */
+  remove(journal->filename);
+#endif
+  if (rename(tmpname, journal->filename) != 0)
+    {
+      printf("\nError replacing journal file %s: %s\n", journal->filename, strerror(errno));
+      remove(tmpname);
+      free(tmpname);
+      return ERR_JOURNAL_UNWRITABLE;
+    }
+  free(tmpname);
+  return OK;
+}
+
+int read_journal(const char *filename, journal_t *journal)
+{
+  FILE *jfile;
+  char line[JOURNAL_LINE];
+  char magic[32];
+  int version, num_files, offset, i;
+  size_t len;
+
+  jfile = fopen(filename, "rb");
+  if (jfile == NULL)
+    {
+      printf("Unable to open journal file %s\n", filename);
+      return ERR_JOURNAL_UNREADABLE;
+    }
+
+  if (fgets(line, sizeof line, jfile) == NULL
+      || sscanf(line, "%31s %d", magic, &version) != 2
+      || strcmp(magic, JOURNAL_MAGIC) != 0
+      || version != JOURNAL_VERSION)
+    {
+      printf("%s is not a version %d rescale journal\n", filename, JOURNAL_VERSION);
+      fclose(jfile);
+      return ERR_JOURNAL_UNREADABLE;
+    }
+
+  /* a journal from the other data type build is of no use to us */
+  if (fgets(line, sizeof line, jfile) == NULL || strncmp(line, "dtype ", 6) != 0)
+    {
+      printf("Journal %s is truncated or corrupt\n", filename);
+      fclose(jfile);
+      return ERR_JOURNAL_UNREADABLE;
+    }
+  line[strcspn(line, "\r\n")] = '\0';
+  if (strcmp(line + 6, RESCALE_DTYPE) != 0)
+    {
+      printf("Journal %s was written for %s data, not %s\n", filename, line + 6, RESCALE_DTYPE);
+      fclose(jfile);
+      return ERR_JOURNAL_DOES_NOT_MATCH_INPUTS;
+    }
+
+  /* sizes are not known until the 'files' line, so read the scalars first */
+  {
+    float threshold, lowval, scalerange;
+    int nbins, policy;
+    if (fgets(line, sizeof line, jfile) == NULL || sscanf(line, "threshold %a", &threshold) != 1
+	|| fgets(line, sizeof line, jfile) == NULL || sscanf(line, "bins %d", &nbins) != 1
+	|| fgets(line, sizeof line, jfile) == NULL || sscanf(line, "lowval %a", &lowval) != 1
+	|| fgets(line, sizeof line, jfile) == NULL || sscanf(line, "scalerange %a", &scalerange) != 1
+	|| fgets(line, sizeof line, jfile) == NULL || sscanf(line, "policy %d", &policy) != 1
+	|| fgets(line, sizeof line, jfile) == NULL || sscanf(line, "files %d", &num_files) != 1
+	|| num_files < 1)
+      {
+	printf("Journal %s is truncated or corrupt\n", filename);
+	fclose(jfile);
+	return ERR_JOURNAL_UNREADABLE;
+      }
+
+    if (init_journal(journal, filename, num_files) != OK)
+      {
+	fclose(jfile);
+	return ERR_JOURNAL_UNREADABLE;
+      }
+    journal->threshold = threshold;
+    journal->nbins = nbins;
+    journal->lowval = lowval;
+    journal->scalerange = scalerange;
+    journal->policy = policy;
+  }
+
+  for (i = 0; i < num_files; i++)
+    {
+      if (fgets(line, sizeof line, jfile) == NULL
+	  || sscanf(line, "file %" SCNd64 " %" SCNd64 " %" SCNu64 " %a %a %n",
+		    &journal->input_sizes[i],
+		    &journal->input_mtimes[i],
+		    &journal->committed[i],
+		    &journal->file_lowvals[i],
+		    &journal->file_scaleranges[i],
+		    &offset) != 5)
+	{
+	  printf("Journal %s is truncated or corrupt\n", filename);
+	  fclose(jfile);
+	  free_journal(journal);
+	  return ERR_JOURNAL_UNREADABLE;
+	}
+      line[strcspn(line, "\r\n")] = '\0';
+      len = strlen(line + offset);
+      journal->input_files[i] = malloc(sizeof(char) * (1+len));
+      strcpy(journal->input_files[i], line + offset);
+    }
+
+  fclose(jfile);
+  return OK;
+}
+
+/* make sure a journal describes exactly the run we have been asked to
+   resume - same files, untouched since, same options */
+int check_journal(journal_t *journal, char **input_files, int num_input_files, float threshold, int nbins, int policy)
+{
+  int i;
+
+  if (journal->num_files != num_input_files)
+    {
+      printf("Journal lists %d input files, but %d were given\n", journal->num_files, num_input_files);
+      return ERR_JOURNAL_DOES_NOT_MATCH_INPUTS;
+    }
+  if (journal->threshold != threshold || journal->nbins != nbins)
+    {
+      printf("Journal was written with threshold %0.4f and %d bins, but threshold %0.4f and %d bins were requested\n",
+	     journal->threshold, journal->nbins, threshold, nbins);
+      return ERR_JOURNAL_DOES_NOT_MATCH_INPUTS;
+    }
+  if (journal->policy != policy)
+    {
+      printf("Journal was written with scaling policy %s, but %s was requested\n",
+	     SCALE_POLICY_NAME(journal->policy), SCALE_POLICY_NAME(policy));
+      return ERR_JOURNAL_DOES_NOT_MATCH_INPUTS;
+    }
+  for (i = 0; i < num_input_files; i++)
+    {
+      if (strcmp(journal->input_files[i], input_files[i]) != 0)
+	{
+	  printf("Journal lists input file %d as %s, but %s was given\n", i+1, journal->input_files[i], input_files[i]);
+	  return ERR_JOURNAL_DOES_NOT_MATCH_INPUTS;
+	}
+      if (journal->input_sizes[i] != get_filesize(input_files[i])
+	  || journal->input_mtimes[i] != get_filemtime(input_files[i]))
+	{
+	  printf("%s has changed since the journal was written\n", input_files[i]);
+	  return ERR_JOURNAL_DOES_NOT_MATCH_INPUTS;
+	}
+      if (journal->committed[i] * sizeof(raw_t) > (uint64_t)journal->input_sizes[i])
+	{
+	  printf("Journal claims more output for %s than there is input\n", input_files[i]);
+	  return ERR_JOURNAL_DOES_NOT_MATCH_INPUTS;
+	}
+    }
+  return OK;
 }
 
 char *read_update_size_vgi(char *vgifile, int x, int y, int z)
@@ -321,71 +865,854 @@ void strip_ext(char *fname)
     }
 }
 
-
-int main(int argc, char **argv)
+int ends_with(const char *str, const char *suffix)
 {
-  int i, opt, a; /* signed int counter, option counter, absolute argument counter */
-  raw_t maxval, minval, lowval, highval; /* maximum/minimum raw_t values, and low/high raw_t values computed from histogram */
-  float range, scalerange, binsize; /* full range, range for scaling and histogram bin size */
-  uint64_t nvals; /* number of values defined across all inputs */
-  float pvals, bfac; /* cumulative summation of percentile points across the histogram to find bin value, 'bin factor' */
-  float t_low, t_high; /* low and high percentile thresholds */
-  uint64_t total_size_input, total_size_read, total_size_written; /* I/O counters */
-  raw_t *inbuffer; /* 32-bit raw_t read buffer */
-  unsigned char *outbuffer; /* 8-bit unsigned integer write buffer */
-  int nbins; /* number of histogram bins */
-  uint64_t *histogram; /* collective histogram data */
-  time_t clk_start, clk_split; /* performance timers */
-  float threshold; /* single threshold value for command-line overriding (prior to t_low/t_high being assigned) */
-  int num_input_files; /* number of input files */
-  char **input_files; /* names of input files */
-  char **output_files; /* names of output files */
-  char *processed_suffix; /* suffix for output files */
-  uint64_t buffer_count; /* number of elements in a buffer */
-  int x, y, z; /* sizes of the volume, read from .vgi file */
-  int auto_flag;
-  char *vol_file_name;
-  /* initialise some values */
-  i = 0;
-  nvals = 0;
-  pvals = 0.0;
-  total_size_input = 0;
-  total_size_read = 0;
-  total_size_written = 0;
-  x = 0;
-  y = 0;
-  z = 0;
-  num_input_files = 0;
-  buffer_count = BUFFER_COUNT;
-  nbins = DEFAULT_HISTOGRAM_BINS;
-  threshold = THRESHOLD;
-  processed_suffix = malloc(sizeof(char) * (1+strlen(PROCESSED_SUFFIX)));
-  snprintf(processed_suffix, sizeof(char)*(1+strlen(PROCESSED_SUFFIX)), "%s", PROCESSED_SUFFIX);
-  time(&clk_start);
-  auto_flag = 0;
-  vol_file_name = malloc(sizeof(char) * 1028);
+  size_t len, suffix_len;
+  len = strlen(str);
+  suffix_len = strlen(suffix);
+  return len >= suffix_len && strcmp(str + len - suffix_len, suffix) == 0;
+}
 
-  /* dump information before we start doing anything */
-  info();
+/* empties a running histogram into the given bins; in the 16-bit build
+   the whole value range is known up front, so its bins never move */
+void init_running_histogram(running_histogram_t *hist, uint64_t *bins, int nbins)
+{
+  hist->bins = bins;
+  hist->nbins = nbins;
+  hist->stale = 0;
+  if (bins != NULL)
+    {
+      memset(bins, 0, sizeof(uint64_t) * (nbins+1));
+    }
+#ifdef UINT16
+  hist->origin = 0.0;
+  hist->width = 65535.0 / nbins;
+  hist->has_range = 1;
+#else
+  hist->origin = 0.0;
+  hist->width = 0.0;
+  hist->has_range = 0;
+#endif
+}
 
-  /* sanity check */
-  if (sizeof(float) != 4) /* really, I should switch this type out ... */
+/* double the width of the bins as many times as it takes for value to
+   fit, growing towards it, and merge the old bins into the new ones in
+   a single sweep; each old bin falls wholly within one new bin */
+void widen_running_histogram(running_histogram_t *hist, double value)
+{
+  double span;
+  int doublings, downwards, j, target;
+  uint64_t count;
+
+  span = hist->nbins * hist->width;
+  downwards = (value < hist->origin);
+  doublings = 0;
+  while (value < hist->origin || value > hist->origin + span)
     {
-      printf("Whoops. The size of a float is not 4 bytes. Cowardly refusing to continue. Go see Rich\n");
-      return ERR_FLOAT_SIZE_NOT_PARTICULARLY_THIRTY_TWO_BIT_FLOATY;
+      if (downwards == 1) { hist->origin -= span; }
+      span *= 2;
+      doublings++;
     }
+  hist->width = span / hist->nbins;
 
-  /* handle command-line options */
-  while ((opt = getopt(argc, argv, "ahb:t:s:n:")) != -1)
+  /* once the bins have doubled this often, everything old ends up in
+     the one bin at the end we grew away from */
+  if (downwards == 1)
     {
-      switch(opt)
+      for (j = hist->nbins - 1; j >= 0; j--)
 	{
-	case 'h':
-	  usage();
-	  return ERR_HELP_REQUESTED;
-	case 'b':
-	  buffer_count = strtoul(optarg, NULL, 10);
-	  if (buffer_count == 0)
+	  target = (doublings < 32) ? (int)(((((uint64_t)1 << doublings) - 1) * hist->nbins + j) >> doublings) : hist->nbins - 1;
+	  count = hist->bins[j];
+	  hist->bins[j] = 0;
+	  hist->bins[target] += count;
+	}
+    }
+  else
+    {
+      for (j = 0; j < hist->nbins; j++)
+	{
+	  target = (doublings < 32) ? (j >> doublings) : 0;
+	  count = hist->bins[j];
+	  hist->bins[j] = 0;
+	  hist->bins[target] += count;
+	}
+    }
+}
+
+/* fold a block of values into a running histogram, starting it off
+   with the extents of the first block */
+void fold_into_histogram(running_histogram_t *hist, raw_t *buffer, size_t nelements)
+{
+  size_t u;
+  double factor;
+  int bin;
+#ifndef UINT16
+  double top;
+  raw_t lo, hi;
+  int first;
+
+  if (hist->has_range == 0)
+    {
+      lo = 0;
+      hi = 0;
+      first = 1;
+      for (u = 0; u < nelements; u++)
+	{
+	  if (!isfinite(buffer[u])) { continue; }
+	  if (first == 1 || buffer[u] < lo) { lo = buffer[u]; }
+	  if (first == 1 || buffer[u] > hi) { hi = buffer[u]; }
+	  first = 0;
+	}
+      if (first == 1)
+	{
+	  return;
+	}
+      hist->origin = lo;
+      hist->width = ((double)hi - lo) / hist->nbins;
+      if (!(hist->width > 0))
+	{
+	  /* one value so far; start as narrow as a float can tell apart */
+	  hist->width = ((lo < 0) ? -lo : lo) * FLT_EPSILON;
+	  if (!(hist->width > 0)) { hist->width = FLT_MIN; }
+	}
+      hist->has_range = 1;
+    }
+  top = hist->origin + hist->nbins * hist->width;
+#endif
+
+  factor = 1.0 / hist->width;
+  for (u = 0; u < nelements; u++)
+    {
+#ifdef UINT16
+      /* do not count values of exactly zero for this; skew on Versa reconstructor */
+      if (buffer[u] == 0 || buffer[u] == 65535 ) { continue; }
+#else
+      /* Inf/NaN have no bin, and would have the bins widen forever */
+      if (!isfinite(buffer[u])) { continue; }
+      if (buffer[u] < hist->origin || buffer[u] > top)
+	{
+	  widen_running_histogram(hist, buffer[u]);
+	  factor = 1.0 / hist->width;
+	  top = hist->origin + hist->nbins * hist->width;
+	}
+#endif
+      bin = (int)((buffer[u] - hist->origin) * factor);
+      if (bin >= hist->nbins) { bin = hist->nbins - 1; }
+      hist->bins[bin]++;
+    }
+}
+
+/* the scaling values from a running histogram, as for any other */
+void running_percentile_extents(running_histogram_t *hist, float t_low, float t_high, float *lowval, float *scalerange)
+{
+  raw_t low, high;
+  if (hist->has_range == 0)
+    {
+      *lowval = 0.0;
+      *scalerange = 0.0;
+      return;
+    }
+  find_percentile_extents(hist->bins, hist->nbins, (raw_t)hist->origin, (raw_t)(hist->origin + hist->nbins * hist->width), t_low, t_high, &low, &high);
+  *lowval = low;
+  *scalerange = high - low;
+}
+
+/* hands out a set of bins, reusing one given back earlier if it can */
+uint64_t *take_bins(bin_pool_t *pool)
+{
+  if (pool->count > 0)
+    {
+      return pool->bins[--pool->count];
+    }
+  return calloc(pool->nbins+1, sizeof(uint64_t));
+}
+
+void give_back_bins(bin_pool_t *pool, uint64_t *bins)
+{
+  if (bins == NULL)
+    {
+      return;
+    }
+  pool->bins = realloc(pool->bins, sizeof(uint64_t *) * (pool->count + 1));
+  pool->bins[pool->count++] = bins;
+}
+
+/* a data file has been written and closed, so work out its own scaling
+   from the histogram folded in as it arrived and give the bins back;
+   only a handful of files are ever being written at once */
+void settle_watch_file(watch_file_t *watch_file, bin_pool_t *pool, float threshold)
+{
+  if (watch_file->histogram.bins == NULL)
+    {
+      return;
+    }
+  if (watch_file->has_values == 1)
+    {
+      running_percentile_extents(&watch_file->histogram, threshold, 1-threshold, &watch_file->lowval, &watch_file->scalerange);
+      watch_file->settled = 1;
+    }
+  give_back_bins(pool, watch_file->histogram.bins);
+  watch_file->histogram.bins = NULL;
+}
+
+/* forget everything folded in from a data file which has been replaced
+   or cut short; the batch histogram still counts its old values, so the
+   batch will have to be binned again from scratch */
+void restart_watch_file(watch_file_t *watch_file, running_histogram_t *histogram)
+{
+  if (watch_file->folded > 0)
+    {
+      histogram->stale = 1;
+    }
+  watch_file->folded = 0;
+  watch_file->has_values = 0;
+  watch_file->settled = 0;
+  if (watch_file->histogram.bins != NULL)
+    {
+      init_running_histogram(&watch_file->histogram, watch_file->histogram.bins, watch_file->histogram.nbins);
+    }
+}
+
+/* fold whatever has landed in a data file since we last looked into its
+   running extents and into the batch histogram - and, given a pool of
+   bins to draw on, its own histogram - provided at least min_bytes of
+   whole values are waiting; a file that has shrunk has been rewritten */
+int fold_new_data(watch_file_t *watch_file, running_histogram_t *histogram, bin_pool_t *pool, raw_t *buffer, uint64_t bufcount, uint64_t min_bytes)
+{
+  FILE *infile;
+  int64_t fsize;
+  uint64_t available, u;
+  size_t read_elements;
+
+  fsize = get_filesize(watch_file->filename);
+  if (fsize == -1)
+    {
+      printf("Unable to read stats of %s\n", watch_file->filename);
+      return ERR_FILE_STATS_UNREADABLE_DESPITE_FILE_BEING_READABLE;
+    }
+  if ((uint64_t)fsize < watch_file->folded)
+    {
+      printf("%s has been cut short, starting it again\n", watch_file->filename);
+      restart_watch_file(watch_file, histogram);
+    }
+  available = (uint64_t)fsize - watch_file->folded;
+  available -= available % sizeof(raw_t);
+  if (available == 0 || available < min_bytes)
+    {
+      return OK;
+    }
+
+  /* its own histogram has already been settled and its bins handed on */
+  if (watch_file->settled == 1 && histogram->stale == 0)
+    {
+      printf("%s was written to again after it was closed\n", watch_file->filename);
+      histogram->stale = 1;
+    }
+  if (pool != NULL && watch_file->histogram.bins == NULL && watch_file->settled == 0)
+    {
+      init_running_histogram(&watch_file->histogram, take_bins(pool), pool->nbins);
+    }
+
+  infile = fopen(watch_file->filename, "rb");
+  if (infile == NULL || seek_file(infile, watch_file->folded) != 0)
+    {
+      printf("Unable to read %s from byte %" PRIu64 "\n", watch_file->filename, watch_file->folded);
+      if (infile != NULL) { fclose(infile); }
+      return ERR_FAILED_TO_OPEN_THE_FILE_DESPITE_EVERYTHING_ELSE;
+    }
+
+  while (available > 0)
+    {
+      read_elements = fread(buffer, sizeof(raw_t), (available / sizeof(raw_t) < bufcount) ? available / sizeof(raw_t) : bufcount, infile);
+      if (read_elements == 0)
+	{
+	  break;
+	}
+      if (watch_file->has_values == 0)
+	{
+	  watch_file->minval = buffer[0];
+	  watch_file->maxval = buffer[0];
+	  watch_file->has_values = 1;
+	}
+      for (u = 0; u < read_elements; u++)
+	{
+	  if (buffer[u] < watch_file->minval) { watch_file->minval = buffer[u]; }
+	  if (buffer[u] > watch_file->maxval) { watch_file->maxval = buffer[u]; }
+	}
+      fold_into_histogram(histogram, buffer, read_elements);
+      if (watch_file->histogram.bins != NULL)
+	{
+	  fold_into_histogram(&watch_file->histogram, buffer, read_elements);
+	}
+      watch_file->folded += read_elements * sizeof(raw_t);
+      available -= read_elements * sizeof(raw_t);
+    }
+  fclose(infile);
+
+  printf("Folded %s up to %0.3f GiB - min/max values now %0.4f / %0.4f\n",
+	 watch_file->filename, (float)watch_file->folded / GIBI, (float)watch_file->minval, (float)watch_file->maxval);
+  return OK;
+}
+
+int find_watch_file(watch_file_t *pending, int num_pending, const char *filename)
+{
+  int i;
+  for (i = 0; i < num_pending; i++)
+    {
+      if (strcmp(pending[i].filename, filename) == 0) { return i; }
+    }
+  return -1;
+}
+
+/* takes a file off the pending list, keeping the rest in order */
+void remove_watch_file(watch_file_t *pending, int *num_pending, int index, bin_pool_t *pool)
+{
+  if (pending[index].histogram.bins != NULL)
+    {
+      give_back_bins(pool, pending[index].histogram.bins);
+    }
+  free(pending[index].filename);
+  memmove(&pending[index], &pending[index+1], sizeof(watch_file_t) * (*num_pending - index - 1));
+  (*num_pending)--;
+}
+
+/* adds a file to the pending list, if it is not already on it, and
+   returns its index */
+int add_watch_file(watch_file_t **pending, int *num_pending, const char *filename)
+{
+  int i;
+  i = find_watch_file(*pending, *num_pending, filename);
+  if (i != -1)
+    {
+      return i;
+    }
+  *pending = realloc(*pending, sizeof(watch_file_t) * (*num_pending + 1));
+  i = (*num_pending)++;
+  (*pending)[i].filename = malloc(sizeof(char) * (1+strlen(filename)));
+  strcpy((*pending)[i].filename, filename);
+  (*pending)[i].folded = 0;
+  (*pending)[i].has_values = 0;
+  (*pending)[i].histogram.bins = NULL;
+  (*pending)[i].settled = 0;
+  (*pending)[i].lowval = 0.0;
+  (*pending)[i].scalerange = 0.0;
+  printf("New data file %s\n", filename);
+  return i;
+}
+
+/* read a whole batch back to bin it from scratch, for when what was
+   folded in as it arrived no longer matches what is on disk; given a
+   pool of bins, the per-file scalings are worked out again as well */
+void rebin_watch_batch(watch_file_t *pending, int num_pending, float threshold, running_histogram_t *histogram, bin_pool_t *pool, uint64_t buffer_count, raw_t *inbuffer, time_t clk_split, float *lowval, float *scalerange)
+{
+  int i, num_files, attempt, moved, nbins;
+  raw_t minval, maxval, highval, file_lowval, file_highval, seen_minval, seen_maxval, low;
+  float range, bfac, file_range;
+  uint64_t total_size_input, total_size_read;
+  uint64_t *file_histogram;
+
+  nbins = histogram->nbins;
+  file_histogram = (pool != NULL) ? take_bins(pool) : NULL;
+  minval = 0;
+  maxval = 0;
+  for (attempt = 0; attempt < 2; attempt++)
+    {
+      total_size_input = 0;
+      num_files = 0;
+      for (i = 0; i < num_pending; i++)
+	{
+	  if (pending[i].has_values == 0)
+	    {
+	      continue;
+	    }
+	  if (num_files == 0 || pending[i].minval < minval) { minval = pending[i].minval; }
+	  if (num_files == 0 || pending[i].maxval > maxval) { maxval = pending[i].maxval; }
+	  total_size_input += pending[i].folded;
+	  num_files++;
+	}
+
+      range = maxval - minval;
+      printf("Established min/max values as %0.4f and %0.4f - range is %0.4f\n", (float)minval, (float)maxval, (float)range);
+      bfac = ((float)nbins) / range;
+      memset(histogram->bins, 0, sizeof(uint64_t) * (nbins+1));
+
+      printf("\n[Binning again from scratch]\n");
+      total_size_read = 0;
+      moved = 0;
+      for (i = 0; i < num_pending; i++)
+	{
+	  if (pending[i].has_values == 0)
+	    {
+	      continue;
+	    }
+	  file_range = pending[i].maxval - pending[i].minval;
+	  seen_minval = pending[i].minval;
+	  seen_maxval = pending[i].maxval;
+	  if (file_histogram != NULL)
+	    {
+	      memset(file_histogram, 0, sizeof(uint64_t) * (nbins+1));
+	    }
+	  total_size_read = build_histogram(pending[i].filename, histogram->bins, nbins, minval, bfac,
+					    file_histogram, pending[i].minval, (file_range > 0) ? ((float)nbins) / file_range : 0.0f,
+					    &seen_minval, &seen_maxval, total_size_read, total_size_input, buffer_count, inbuffer, clk_split);
+	  if (seen_minval < pending[i].minval || seen_maxval > pending[i].maxval)
+	    {
+	      printf("%s was rewritten in place - min/max values now %0.4f / %0.4f\n", pending[i].filename, (float)seen_minval, (float)seen_maxval);
+	      pending[i].minval = seen_minval;
+	      pending[i].maxval = seen_maxval;
+	      moved = 1;
+	    }
+	  if (file_histogram != NULL)
+	    {
+	      find_percentile_extents(file_histogram, nbins, pending[i].minval, pending[i].maxval, threshold, 1-threshold, &file_lowval, &file_highval);
+	      pending[i].lowval = file_lowval;
+	      pending[i].scalerange = file_highval - file_lowval;
+	    }
+	}
+      if (moved == 0)
+	{
+	  break;
+	}
+      if (attempt == 1)
+	{
+	  printf("Warning: data is still changing under us; out-of-range values have been binned at the ends\n");
+	}
+    }
+
+  find_percentile_extents(histogram->bins, nbins, minval, maxval, threshold, 1-threshold, &low, &highval);
+  *lowval = low;
+  *scalerange = highval - low;
+  if (file_histogram != NULL)
+    {
+      give_back_bins(pool, file_histogram);
+    }
+}
+
+/* the .vgi has landed, so every pending file is complete: the extents
+   and histograms are already folded in, leaving only the tails and the
+   conversion pass, which should mostly be served from the page cache */
+int convert_watch_batch(watch_file_t *pending, int num_pending, char *vgi_file, char *processed_suffix, int auto_flag, int policy, float threshold, running_histogram_t *histogram, bin_pool_t *pool, uint64_t buffer_count, raw_t *inbuffer, unsigned char *outbuffer, char **produced, int *num_produced)
+{
+  int i, num_files, status, attempt, moved, rebin;
+  raw_t minval, maxval, seen_minval, seen_maxval;
+  float lowval, scalerange;
+  uint64_t total_size_input, total_size_read, total_size_written;
+  char *suffix, *output_file, *perfile_output_file;
+  time_t clk_split;
+
+  time(&clk_split);
+
+  for (i = 0; i < num_pending; i++)
+    {
+      /* pick up any tail still outstanding; a file which has gone away
+	 since is no reason to lose the rest of the volume */
+      if (fold_new_data(&pending[i], histogram, pool, inbuffer, buffer_count, 0) != OK)
+	{
+	  printf("Warning: skipping %s, which can no longer be read\n", pending[i].filename);
+	  if (pending[i].folded > 0) { histogram->stale = 1; }
+	  pending[i].has_values = 0;
+	}
+    }
+
+  total_size_input = 0;
+  num_files = 0;
+  minval = 0;
+  maxval = 0;
+  for (i = 0; i < num_pending; i++)
+    {
+      if (pending[i].has_values == 0)
+	{
+	  continue;
+	}
+      if (num_files == 0 || pending[i].minval < minval) { minval = pending[i].minval; }
+      if (num_files == 0 || pending[i].maxval > maxval) { maxval = pending[i].maxval; }
+      total_size_input += pending[i].folded;
+      num_files++;
+    }
+  if (num_files == 0)
+    {
+      printf("No data waiting for %s, nothing to do\n", vgi_file);
+      return OK;
+    }
+  printf("\n[Converting %d file(s) for %s]\n", num_files, vgi_file);
+
+  suffix = processed_suffix;
+  if (auto_flag == 1)
+    {
+      suffix = read_update_size_vgi(vgi_file, 0, 0, 0);
+    }
+
+  /* the histograms folded in as the data arrived only cover each byte
+     as it first landed; anything since replaced, cut short or rewritten
+     in place with values beyond the extents means binning it all again */
+  rebin = histogram->stale;
+  status = OK;
+  for (attempt = 0; attempt < 2; attempt++)
+    {
+      if (rebin == 1)
+	{
+	  rebin_watch_batch(pending, num_pending, threshold, histogram, pool, buffer_count, inbuffer, clk_split, &lowval, &scalerange);
+	}
+      else
+	{
+	  printf("Established min/max values as %0.4f and %0.4f - range is %0.4f\n", (float)minval, (float)maxval, (float)(maxval - minval));
+	  running_percentile_extents(histogram, threshold, 1-threshold, &lowval, &scalerange);
+	  for (i = 0; i < num_pending && pool != NULL; i++)
+	    {
+	      settle_watch_file(&pending[i], pool, threshold);
+	    }
+	}
+      printf("Low value is %0.4f, high value is %0.4f, scaling range is %0.4f\n", lowval, lowval + scalerange, scalerange);
+
+      printf("\n[Read pass: performing conversion and writing output]\n");
+      total_size_read = 0;
+      total_size_written = 0;
+      moved = 0;
+      for (i = 0; i < num_pending; i++)
+	{
+	  if (pending[i].has_values == 0)
+	    {
+	      continue;
+	    }
+	  output_file = (policy & SCALE_GLOBAL) ? make_output_name(pending[i].filename, "", suffix) : NULL;
+	  perfile_output_file = NULL;
+	  if (policy & SCALE_PER_FILE)
+	    {
+	      perfile_output_file = make_output_name(pending[i].filename, (policy == SCALE_BOTH) ? PERFILE_TAG : "", suffix);
+	    }
+
+	  seen_minval = pending[i].minval;
+	  seen_maxval = pending[i].maxval;
+	  if (convert_data(pending[i].filename, output_file, perfile_output_file, inbuffer, outbuffer, lowval, scalerange, pending[i].lowval, pending[i].scalerange, buffer_count, &total_size_read, &total_size_written, total_size_input, &seen_minval, &seen_maxval, NULL, i) != OK)
+	    {
+	      printf("Warning: conversion of %s failed\n", pending[i].filename);
+	      status = ERR_FAILED_TO_WRITE_OUTPUT;
+	    }
+	  if (seen_minval < pending[i].minval || seen_maxval > pending[i].maxval)
+	    {
+	      printf("%s was rewritten in place - min/max values now %0.4f / %0.4f\n", pending[i].filename, (float)seen_minval, (float)seen_maxval);
+	      pending[i].minval = seen_minval;
+	      pending[i].maxval = seen_maxval;
+	      moved = 1;
+	    }
+
+	  /* remember what this batch writes so that the events it raises
+	     are ignored; the second time round the names are already there */
+	  if (attempt == 0)
+	    {
+	      if (output_file != NULL) { produced[(*num_produced)++] = output_file; }
+	      if (perfile_output_file != NULL) { produced[(*num_produced)++] = perfile_output_file; }
+	    }
+	  else
+	    {
+	      free(output_file);
+	      free(perfile_output_file);
+	    }
+	}
+
+      if (moved == 0)
+	{
+	  break;
+	}
+      if (rebin == 1)
+	{
+	  printf("Warning: data is still changing under us; these outputs may not be scaled consistently\n");
+	  break;
+	}
+      rebin = 1;
+      status = OK;
+    }
+
+  if (suffix != processed_suffix && strcmp(suffix, PROCESSED_SUFFIX) != 0)
+    {
+      free(suffix);
+    }
+  printf("Converted %d file(s) for %s in %0.1f seconds\n", num_files, vgi_file, difftime(time(NULL), clk_split));
+  return status;
+}
+
+#ifdef INOTIFY
+/* after the event queue has overflowed we cannot know what was missed,
+   so pick up every data file touched since the last conversion began */
+void rescan_directory(char *watch_dir, char *watch_extension, char *processed_suffix, watch_file_t **pending, int *num_pending, time_t since)
+{
+  DIR *dir;
+  struct dirent *entry;
+  char *path, *output_file, *perfile_output_file;
+  int64_t mtime;
+
+  dir = opendir(watch_dir);
+  if (dir == NULL)
+    {
+      printf("Unable to rescan %s: %s\n", watch_dir, strerror(errno));
+      return;
+    }
+  while ((entry = readdir(dir)) != NULL)
+    {
+      if (entry->d_name[0] == '.' || !ends_with(entry->d_name, watch_extension) || ends_with(entry->d_name, processed_suffix))
+	{
+	  continue;
+	}
+      path = malloc(sizeof(char) * (2+strlen(watch_dir)+strlen(entry->d_name)));
+      sprintf(path, "%s/%s", watch_dir, entry->d_name);
+      /* mtimes are only to the second, so also pass over anything whose
+	 output is already at least as new as it is */
+      output_file = make_output_name(path, "", processed_suffix);
+      perfile_output_file = make_output_name(path, PERFILE_TAG, processed_suffix);
+      mtime = get_filemtime(path);
+      if (mtime >= (int64_t)since && get_filemtime(output_file) < mtime && get_filemtime(perfile_output_file) < mtime)
+	{
+	  add_watch_file(pending, num_pending, path);
+	}
+      free(perfile_output_file);
+      free(output_file);
+      free(path);
+    }
+  closedir(dir);
+}
+
+/* watch a directory for data files and .vgi files as they are written,
+   keeping the buffers allocated between volumes; runs until killed */
+int watch_directory(char *watch_dir, char *watch_extension, char *processed_suffix, int auto_flag, int policy, float threshold, int nbins, uint64_t *histogram, uint64_t buffer_count, raw_t *inbuffer, unsigned char *outbuffer)
+{
+  union
+  {
+    struct inotify_event event; /* keeps the buffer aligned for events */
+    char bytes[WATCH_EVENT_BUFFER];
+  } events;
+  struct inotify_event *event;
+  watch_file_t *pending;
+  running_histogram_t batch_histogram;
+  bin_pool_t pool, *file_pool;
+  char **produced;
+  char *path;
+  int fd, i, num_pending, num_produced, is_output;
+  time_t last_batch;
+  ssize_t len;
+  char *p;
+
+  fd = inotify_init();
+  if (fd == -1 || inotify_add_watch(fd, watch_dir, IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM) == -1)
+    {
+      printf("Unable to watch %s: %s\n", watch_dir, strerror(errno));
+      return ERR_WATCH_FAILED;
+    }
+  printf("[Watching %s for *%s data files and .vgi files]\n", watch_dir, watch_extension);
+
+  /* everything a batch needs is kept from one to the next: the batch
+     histogram, the bins of per-file histograms once their files have
+     been closed, and room for the names of the outputs of one batch,
+     which is all we need to recognise them */
+  init_running_histogram(&batch_histogram, histogram, nbins);
+  pool.bins = NULL;
+  pool.count = 0;
+  pool.nbins = nbins;
+  file_pool = (policy & SCALE_PER_FILE) ? &pool : NULL;
+  pending = NULL;
+  num_pending = 0;
+  produced = NULL;
+  num_produced = 0;
+  time(&last_batch);
+
+  for (;;)
+    {
+      /* a daemon's output usually ends up in a log, so do not sit on it */
+      fflush(stdout);
+      len = read(fd, events.bytes, sizeof events.bytes);
+      if (len == -1 && errno == EINTR)
+	{
+	  continue;
+	}
+      if (len <= 0)
+	{
+	  printf("Error reading events for %s: %s\n", watch_dir, strerror(errno));
+	  return ERR_WATCH_FAILED;
+	}
+
+      for (p = events.bytes; p < events.bytes + len; p += sizeof(struct inotify_event) + event->len)
+	{
+	  event = (struct inotify_event *)p;
+	  if (event->mask & IN_Q_OVERFLOW)
+	    {
+	      printf("***WARNING*** inotify event queue overflowed, events for %s have been lost. Rescanning for data files;\n", watch_dir);
+	      printf("***WARNING*** if a .vgi file was lost, its volume will be converted along with the next one.\n");
+	      rescan_directory(watch_dir, watch_extension, processed_suffix, &pending, &num_pending, last_batch);
+	      continue;
+	    }
+	  if (event->len == 0 || event->name[0] == '.' || (event->mask & IN_ISDIR))
+	    {
+	      continue;
+	    }
+
+	  path = malloc(sizeof(char) * (2+strlen(watch_dir)+strlen(event->name)));
+	  sprintf(path, "%s/%s", watch_dir, event->name);
+
+	  if (ends_with(event->name, ".vgi"))
+	    {
+	      if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+		{
+		  time(&last_batch);
+		  while (num_produced > 0)
+		    {
+		      free(produced[--num_produced]);
+		    }
+		  produced = realloc(produced, sizeof(char *) * (2*num_pending + 1));
+		  if (convert_watch_batch(pending, num_pending, path, processed_suffix, auto_flag, policy, threshold, &batch_histogram, file_pool, buffer_count, inbuffer, outbuffer, produced, &num_produced) != OK)
+		    {
+		      printf("Conversion for %s did not complete, carrying on watching\n", path);
+		    }
+		  while (num_pending > 0)
+		    {
+		      remove_watch_file(pending, &num_pending, num_pending - 1, file_pool);
+		    }
+		  init_running_histogram(&batch_histogram, histogram, nbins);
+		}
+	      free(path);
+	      continue;
+	    }
+
+	  /* deleted or moved away: forget it */
+	  if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+	    {
+	      i = find_watch_file(pending, num_pending, path);
+	      if (i != -1)
+		{
+		  printf("Data file %s has gone away, forgetting it\n", path);
+		  if (pending[i].folded > 0) { batch_histogram.stale = 1; }
+		  remove_watch_file(pending, &num_pending, i, file_pool);
+		}
+	      free(path);
+	      continue;
+	    }
+
+	  is_output = ends_with(event->name, processed_suffix);
+	  for (i = 0; i < num_produced && is_output == 0; i++)
+	    {
+	      if (strcmp(produced[i], path) == 0) { is_output = 1; }
+	    }
+	  if (is_output == 1 || !ends_with(event->name, watch_extension))
+	    {
+	      free(path);
+	      continue;
+	    }
+
+	  i = add_watch_file(&pending, &num_pending, path);
+	  free(path);
+
+	  /* a file moved in whole replaces whatever we had for it; while it
+	     is still being written, wait for a buffer's worth before reading */
+	  if (event->mask & IN_MOVED_TO)
+	    {
+	      restart_watch_file(&pending[i], &batch_histogram);
+	    }
+	  if (fold_new_data(&pending[i], &batch_histogram, file_pool, inbuffer, buffer_count, (event->mask & IN_MODIFY) ? buffer_count * sizeof(raw_t) : 0) != OK)
+	    {
+	      printf("Warning: dropping %s until it is written to again\n", pending[i].filename);
+	      if (pending[i].folded > 0) { batch_histogram.stale = 1; }
+	      remove_watch_file(pending, &num_pending, i, file_pool);
+	    }
+	  else if ((event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) && file_pool != NULL)
+	    {
+	      /* written and closed: its own histogram is complete */
+	      settle_watch_file(&pending[i], file_pool, threshold);
+	    }
+	}
+    }
+
+  return OK;
+}
+#else
+int watch_directory(char *watch_dir, char *watch_extension, char *processed_suffix, int auto_flag, int policy, float threshold, int nbins, uint64_t *histogram, uint64_t buffer_count, raw_t *inbuffer, unsigned char *outbuffer)
+{
+  printf("Watch mode needs inotify, which this platform does not have\n");
+  return ERR_WATCH_FAILED;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+  int i, opt, a; /* signed int counter, option counter, absolute argument counter */
+  raw_t maxval, minval, lowval, highval; /* maximum/minimum raw_t values, and low/high raw_t values computed from histogram */
+  float range, scalerange, binsize; /* full range, range for scaling and histogram bin size */
+  float bfac, file_range; /* 'bin factor', range of a single file */
+  float t_low, t_high; /* low and high percentile thresholds */
+  uint64_t total_size_input, total_size_read, total_size_written; /* I/O counters */
+  raw_t *inbuffer; /* 32-bit raw_t read buffer */
+  unsigned char *outbuffer; /* 8-bit unsigned integer write buffer */
+  int nbins; /* number of histogram bins */
+  uint64_t *histogram; /* collective histogram data */
+  uint64_t *file_histogram; /* histogram of a single file, reused for each in turn */
+  float *file_lowvals, *file_scaleranges; /* per-file scaling values */
+  raw_t *file_minvals, *file_maxvals; /* per-file minimum/maximum values */
+  raw_t file_lowval, file_highval; /* per-file low/high values computed from histogram */
+  int policy; /* which scalings to write out */
+  time_t clk_start, clk_split; /* performance timers */
+  float threshold; /* single threshold value for command-line overriding (prior to t_low/t_high being assigned) */
+  int num_input_files; /* number of input files */
+  char **input_files; /* names of input files */
+  char **output_files; /* names of output files scaled across all inputs */
+  char **perfile_output_files; /* names of output files scaled individually */
+  char *output_name; /* output name being assembled */
+  char *processed_suffix; /* suffix for output files */
+  uint64_t buffer_count; /* number of elements in a buffer */
+  int x, y, z; /* sizes of the volume, read from .vgi file */
+  int auto_flag;
+  char *vol_file_name;
+  int resume_flag; /* resume a previous run from its journal */
+  char *journal_file; /* name of the journal file */
+  journal_t journal; /* scaling parameters and per-file progress */
+  int status; /* return value from conversion */
+  char *watch_dir; /* directory to watch, if running as a daemon */
+  char *watch_extension; /* extension of data files to pick up when watching */
+  static const struct option long_options[] =
+    {
+      {"resume", no_argument, NULL, 'r'},
+      {NULL, 0, NULL, 0}
+    };
+  /* initialise some values */
+  i = 0;
+  total_size_input = 0;
+  total_size_read = 0;
+  total_size_written = 0;
+  x = 0;
+  y = 0;
+  z = 0;
+  num_input_files = 0;
+  buffer_count = BUFFER_COUNT;
+  nbins = DEFAULT_HISTOGRAM_BINS;
+  threshold = THRESHOLD;
+  processed_suffix = malloc(sizeof(char) * (1+strlen(PROCESSED_SUFFIX)));
+  snprintf(processed_suffix, sizeof(char)*(1+strlen(PROCESSED_SUFFIX)), "%s", PROCESSED_SUFFIX);
+  time(&clk_start);
+  auto_flag = 0;
+  vol_file_name = malloc(sizeof(char) * 1028);
+  resume_flag = 0;
+  policy = SCALE_GLOBAL;
+  watch_dir = NULL;
+  watch_extension = WATCH_EXTENSION;
+  journal_file = NULL; /* named after the outputs, unless -j says otherwise */
+
+  /* dump information before we start doing anything */
+  info();
+
+  /* sanity check */
+  if (sizeof(float) != 4) /* really, I should switch this type out ... */
+    {
+      printf("Whoops. The size of a float is not 4 bytes. Cowardly refusing to continue. Go see Rich\n");
+      return ERR_FLOAT_SIZE_NOT_PARTICULARLY_THIRTY_TWO_BIT_FLOATY;
+    }
+
+  /* handle command-line options */
+  while ((opt = getopt_long(argc, argv, "ahrb:t:s:n:j:p:w:x:", long_options, NULL)) != -1)
+    {
+      switch(opt)
+	{
+	case 'h':
+	  usage();
+	  return ERR_HELP_REQUESTED;
+	case 'b':
+	  buffer_count = strtoul(optarg, NULL, 10);
+	  if (buffer_count == 0)
 	    {
 	      printf("Buffer size set to zero. Exiting now owing to ridiculous constraints\n");
 	      return ERR_STUPID_CONSTRAINTS;
@@ -415,6 +1742,37 @@ int main(int argc, char **argv)
 	  snprintf(processed_suffix, sizeof(char)*(1+strlen(optarg)), "%s", optarg);
 	  printf("Output suffix set to %s\n", processed_suffix);
 	  break;
+	case 'j':
+	  /* assign a new journal file */
+	  free(journal_file);
+	  journal_file = malloc(sizeof(char) * (1+strlen(optarg)));
+	  snprintf(journal_file, sizeof(char)*(1+strlen(optarg)), "%s", optarg);
+	  printf("Journal file set to %s\n", journal_file);
+	  break;
+	case 'r':
+	  /* pick up where a previous run left off */
+	  resume_flag = 1;
+	  break;
+	case 'p':
+	  /* choose the scaling policy */
+	  if (strcmp(optarg, "global") == 0) { policy = SCALE_GLOBAL; }
+	  else if (strcmp(optarg, "file") == 0) { policy = SCALE_PER_FILE; }
+	  else if (strcmp(optarg, "both") == 0) { policy = SCALE_BOTH; }
+	  else
+	    {
+	      printf("Scaling policy should be one of global, file or both, not %s\n", optarg);
+	      return ERR_ARGUMENTS_BEYOND_RECOGNITION;
+	    }
+	  printf("Scaling policy set to %s\n", SCALE_POLICY_NAME(policy));
+	  break;
+	case 'w':
+	  /* run as a daemon on a directory */
+	  watch_dir = optarg;
+	  break;
+	case 'x':
+	  /* data file extension for watch mode */
+	  watch_extension = optarg;
+	  break;
   case 'a':
     /* set the output string to auto, from vgi file */
     auto_flag = 1;
@@ -439,19 +1797,26 @@ int main(int argc, char **argv)
   inbuffer = (raw_t*)malloc(sizeof(raw_t) * buffer_count);
   outbuffer = (unsigned char*)malloc(sizeof(unsigned char*) * buffer_count);
 
-  /* alright, I need to explain this calloc here. There appears to be
-     a peculiar bug buried in at least my version of glibc which
-     causes this to either segfault or throw up an error 'corrupted
-     double-linked list' when this is freed later on.  I couldn't find
-     any sensible reasons as to why, or sensible fixes, however I did
-     notice that this would only occur when there is an odd number of
-     histogram bins. It's not a particularly unlikely edge case so
-     I've simply handled it for now, rightly or wrongly, by allocating
-     an even number of addresses rather than an odd number if an odd
-     number of bins is requested. Cost: sizeof(uint64_t) in
-     memory, and no difference in behaviour (other than it no longer
-     segfaults) as we're still only working up to nbins in our loop. */
-  histogram = malloc(sizeof(uint64_t *) * 1028);//(uint64_t *)malloc(sizeof(uint64_t *) * nbins);
+  /* one spare bin on the end: the maximum value itself lands at
+     exactly nbins, and we still only work up to nbins in our loops */
+  histogram = calloc(nbins+1, sizeof(uint64_t));
+
+  if (watch_dir != NULL)
+    {
+      /* each volume is converted in one go as soon as its .vgi lands, so
+	 there is no journal to keep or resume from */
+      if (resume_flag == 1 || journal_file != NULL)
+	{
+	  printf("-r/--resume and -j cannot be used with -w; watch mode does not keep a journal\n");
+	  return ERR_ARGUMENTS_BEYOND_RECOGNITION;
+	}
+      if (argc > optind)
+	{
+	  printf("Ignoring input files given on the command line in watch mode\n");
+	}
+      return watch_directory(watch_dir, watch_extension, processed_suffix, auto_flag, policy, threshold, nbins, histogram, buffer_count, inbuffer, outbuffer);
+    }
+
   num_input_files = argc - optind; /* how many input files do we have? */
   //printf("%d\n", num_input_files);
   if (num_input_files < 1)
@@ -470,6 +1835,16 @@ int main(int argc, char **argv)
   printf("Working on %d input files\n", num_input_files);
   input_files = malloc(num_input_files * sizeof(char *));
   output_files = malloc(num_input_files * sizeof(char *));
+  perfile_output_files = malloc(num_input_files * sizeof(char *));
+  file_minvals = malloc(num_input_files * sizeof(raw_t));
+  file_maxvals = malloc(num_input_files * sizeof(raw_t));
+  file_lowvals = calloc(num_input_files, sizeof(float));
+  file_scaleranges = calloc(num_input_files, sizeof(float));
+  file_histogram = NULL;
+  if (policy & SCALE_PER_FILE)
+    {
+      file_histogram = calloc(nbins+1, sizeof(uint64_t));
+    }
 
   for (i = 0; i<num_input_files; i++)
     {
@@ -505,75 +1880,171 @@ int main(int argc, char **argv)
 
 	  /* add this to the list */
 	  input_files[i] = (char *)malloc(sizeof(char) * (5+strlen(argv[a])));
-    output_files[i] = (char *)malloc(sizeof(char) * (5+strlen(argv[a])+strlen(processed_suffix)));
 	  snprintf(input_files[i], sizeof(char)*(5+strlen(argv[a])), "%s", argv[a]);
-	  snprintf(output_files[i], sizeof(char)*(5+strlen(argv[a])+strlen(processed_suffix)), "%s%s", argv[a], processed_suffix);
-	  printf("Added file %s to the list of output files\n", output_files[i]);
+	  output_files[i] = NULL;
+	  perfile_output_files[i] = NULL;
+	  output_name = make_output_name(argv[a], "", processed_suffix);
+	  if (policy & SCALE_GLOBAL)
+	    {
+	      output_files[i] = output_name;
+	      printf("Added file %s to the list of output files\n", output_files[i]);
+	    }
+	  if (policy & SCALE_PER_FILE)
+	    {
+	      /* only needs telling apart if both are being written */
+	      if (policy == SCALE_BOTH)
+		{
+		  output_name = make_output_name(argv[a], PERFILE_TAG, processed_suffix);
+		}
+	      perfile_output_files[i] = output_name;
+	      printf("Added file %s to the list of individually scaled output files\n", perfile_output_files[i]);
+	    }
     }
   printf("\n");
 
-  printf("[Preflight checks: populating initial min/max values and setting saturation threshold]\n");
-  /* set the low and high boundaries for saturation threshold */
-  t_low = threshold;
-  t_high = 1-t_low;
+  /* by default the journal sits alongside, and is named after, this
+     run's own outputs, so that runs started from one directory on
+     different inputs each keep their own */
+  if (journal_file == NULL)
+    {
+      journal_file = make_output_name((output_files[0] != NULL) ? output_files[0] : perfile_output_files[0], "", JOURNAL_SUFFIX);
+    }
 
-  printf("Saturation threshold set - percentiles between %0.2f%% and %0.2f%% will be considered\n", 100*t_low, 100*t_high);
+  if (resume_flag == 1)
+    {
+      printf("[Preflight checks: resuming from journal %s]\n", journal_file);
+      status = read_journal(journal_file, &journal);
+      if (status != OK)
+	{
+	  return status;
+	}
+      status = check_journal(&journal, input_files, num_input_files, threshold, nbins, policy);
+      if (status != OK)
+	{
+	  printf("Refusing to resume; run again without --resume to start afresh\n");
+	  return status;
+	}
 
+      /* an output shorter than its journal entry has been tampered with
+	 since; the only safe thing to do is to write it again */
+      for (i = 0; i < num_input_files; i++)
+	{
+	  if (journal.committed[i] > 0
+	      && ((output_files[i] != NULL && get_filesize(output_files[i]) < (int64_t)(journal.committed[i] * sizeof(unsigned char)))
+		  || (perfile_output_files[i] != NULL && get_filesize(perfile_output_files[i]) < (int64_t)(journal.committed[i] * sizeof(unsigned char)))))
+	    {
+	      printf("Output of %s is shorter than the journal says; it will be rewritten\n", input_files[i]);
+	      journal.committed[i] = 0;
+	    }
+	}
 
+      lowval = journal.lowval;
+      scalerange = journal.scalerange;
+      printf("Skipping read passes 1 and 2: low value is %0.4f, scaling range is %0.4f\n", (float)lowval, scalerange);
+    }
+  else
+    {
+      printf("[Preflight checks: populating initial min/max values and setting saturation threshold]\n");
+      /* set the low and high boundaries for saturation threshold */
+      t_low = threshold;
+      t_high = 1-t_low;
 
-  // printf("&maxval is %f\n\n\n", &maxval);
-  /* read the first value of the first file and assign this to max/minval */
-  if (read_first_value(input_files[0], &maxval) != 0)
-  {
-    return ERR_FAILED_TO_OPEN_THE_FILE_DESPITE_EVERYTHING_ELSE;
-  }
+      printf("Saturation threshold set - percentiles between %0.2f%% and %0.2f%% will be considered\n", 100*t_low, 100*t_high);
 
-  minval = maxval;
-  printf("Read first value: maxval is %0.4f, minval is %0.4f\n", (float)maxval, (float)minval);
+      /* read the first value of the first file and assign this to max/minval */
+      if (read_first_value(input_files[0], &maxval) != 0)
+	{
+	  return ERR_FAILED_TO_OPEN_THE_FILE_DESPITE_EVERYTHING_ELSE;
+	}
 
-  time(&clk_split);
-  printf("\n[Read pass 1/3: establishing value extents]\n");
+      minval = maxval;
+      printf("Read first value: maxval is %0.4f, minval is %0.4f\n", (float)maxval, (float)minval);
 
-  for (i=0; i<num_input_files; i++)
-    {
-      total_size_read = find_minmax_values(input_files[i], &minval, &maxval, total_size_read, total_size_input, buffer_count, inbuffer, clk_split);
-    }
+      time(&clk_split);
+      printf("\n[Read pass 1/3: establishing value extents]\n");
 
-  range = maxval - minval;
-  printf("Established min/max values as %0.4f and %0.4f - range is %0.4f\n", (float)minval, (float)maxval, (float)range);
-  binsize = range / (float)nbins;
-  printf("Using %d histogram bins (bin size = %0.4f)\n", nbins, binsize);
-  time(&clk_split);
-  total_size_read = 0;
-  bfac = ((float)nbins) / range; /* inverted; could overload binsize for inner loop below */
+      for (i=0; i<num_input_files; i++)
+	{
+	  total_size_read = find_minmax_values(input_files[i], &minval, &maxval, &file_minvals[i], &file_maxvals[i], total_size_read, total_size_input, buffer_count, inbuffer, clk_split);
+	}
 
-  printf("\n[Read pass 2/3: constructing histogram]\n");
-  for (i=0; i<num_input_files; i++)
-    {
-      total_size_read = build_histogram(input_files[i], histogram, minval, bfac, total_size_read, total_size_input, buffer_count, inbuffer, clk_split);
-    }
+      range = maxval - minval;
+      printf("Established min/max values as %0.4f and %0.4f - range is %0.4f\n", (float)minval, (float)maxval, (float)range);
+      binsize = range / (float)nbins;
+      printf("Using %d histogram bins (bin size = %0.4f)\n", nbins, binsize);
+      time(&clk_split);
+      total_size_read = 0;
+      bfac = ((float)nbins) / range; /* inverted; could overload binsize for inner loop below */
 
-  nvals = calculate_number_of_values(histogram, nbins);
+      printf("\n[Read pass 2/3: constructing histogram]\n");
+      for (i=0; i<num_input_files; i++)
+	{
+	  if (file_histogram != NULL)
+	    {
+	      /* a file of one single value gets everything in its first bin */
+	      file_range = file_maxvals[i] - file_minvals[i];
+	      memset(file_histogram, 0, sizeof(uint64_t) * (nbins+1));
+	      total_size_read = build_histogram(input_files[i], histogram, nbins, minval, bfac,
+						file_histogram, file_minvals[i], (file_range > 0) ? ((float)nbins) / file_range : 0.0f,
+						NULL, NULL, total_size_read, total_size_input, buffer_count, inbuffer, clk_split);
+
+	      /* only the scaling values are kept, so the histogram can go round again */
+	      find_percentile_extents(file_histogram, nbins, file_minvals[i], file_maxvals[i], t_low, t_high, &file_lowval, &file_highval);
+	      file_lowvals[i] = file_lowval;
+	      file_scaleranges[i] = file_highval - file_lowval;
+	    }
+	  else
+	    {
+	      total_size_read = build_histogram(input_files[i], histogram, nbins, minval, bfac, NULL, 0, 0.0f, NULL, NULL, total_size_read, total_size_input, buffer_count, inbuffer, clk_split);
+	    }
+	}
 
-  /* assign these to sensible defaults in case t_low/high is set silly */
-  lowval = minval;
-  highval = maxval;
+      printf("\n[Finding min/max percentile extents in histogram]\n");
 
-  printf("\n[Finding min/max percentile extents in histogram]\n");
+      find_percentile_extents(histogram, nbins, minval, maxval, t_low, t_high, &lowval, &highval);
 
-  for (i=0; i<nbins; i++)
-    {
-     pvals += (float)histogram[i] / (float)nvals;
-     if (pvals < t_low) { lowval = (i * binsize) + minval; }
-     if (pvals <= t_high) { highval = (i*binsize) + minval; }
-   }
+      printf("Low value is %0.4f, high value is %0.4f\n", (float)lowval, (float)highval);
+      printf("Min value is %0.4f, max value is %0.4f\n", (float)minval, (float)maxval);
 
-  printf("Low value is %0.4f, high value is %0.4f\n", (float)lowval, (float)highval);
-  printf("Min value is %0.4f, max value is %0.4f\n", (float)minval, (float)maxval);
+      /* now we have our scaling values */
+      scalerange = highval - lowval;
+      printf("Scaling range is set to %0.4f\n", scalerange);
 
- /* now we have our scaling values */
- scalerange = highval - lowval;
- printf("Scaling range is set to %0.4f\n", scalerange);
+      /* record them before we write anything, so a crash in the
+	 conversion never costs us the first two passes again */
+      if (access(journal_file, F_OK) == 0)
+	{
+	  printf("Overwriting existing journal %s; use --resume to continue an interrupted run instead\n", journal_file);
+	}
+      if (init_journal(&journal, journal_file, num_input_files) != OK)
+	{
+	  printf("Unable to allocate the journal\n");
+	  return ERR_STUPID_CONSTRAINTS;
+	}
+      journal.threshold = threshold;
+      journal.nbins = nbins;
+      journal.lowval = lowval;
+      journal.scalerange = scalerange;
+      journal.policy = policy;
+      for (i = 0; i < num_input_files; i++)
+	{
+	  journal.file_lowvals[i] = file_lowvals[i];
+	  journal.file_scaleranges[i] = file_scaleranges[i];
+	  if (file_histogram != NULL)
+	    {
+	      printf("%s: low value is %0.4f, scaling range is %0.4f\n", input_files[i], file_lowvals[i], file_scaleranges[i]);
+	    }
+	  journal.input_files[i] = malloc(sizeof(char) * (1+strlen(input_files[i])));
+	  strcpy(journal.input_files[i], input_files[i]);
+	  journal.input_sizes[i] = get_filesize(input_files[i]);
+	  journal.input_mtimes[i] = get_filemtime(input_files[i]);
+	}
+      if (write_journal(&journal) != OK)
+	{
+	  printf("Warning: carrying on without the journal %s; this run cannot be resumed\n", journal_file);
+	  journal.enabled = 0;
+	}
+    }
 
  /* reset counters */
  total_size_written = 0;
@@ -583,17 +2054,38 @@ int main(int argc, char **argv)
 
  for (i=0; i<num_input_files; i++)
    {
-     convert_data(input_files[i], output_files[i], inbuffer, outbuffer, lowval, scalerange, buffer_count, &total_size_read, &total_size_written, total_size_input);
+     if (journal.committed[i] * sizeof(raw_t) == (uint64_t)journal.input_sizes[i] - (uint64_t)journal.input_sizes[i] % sizeof(raw_t))
+       {
+	 printf("Output of %s is already complete, skipping\n", input_files[i]);
+	 total_size_read += journal.input_sizes[i];
+	 total_size_written += journal.committed[i] * sizeof(unsigned char) * ((output_files[i] != NULL) + (perfile_output_files[i] != NULL));
+	 continue;
+       }
+     status = convert_data(input_files[i], output_files[i], perfile_output_files[i], inbuffer, outbuffer, lowval, scalerange, journal.file_lowvals[i], journal.file_scaleranges[i], buffer_count, &total_size_read, &total_size_written, total_size_input, NULL, NULL, &journal, i);
+     if (status != OK)
+       {
+	 printf("Conversion stopped; run again with --resume to continue\n");
+	 return status;
+       }
    }
 
+ free_journal(&journal);
+ free(journal_file);
+ free(file_histogram);
+ free(file_scaleranges);
+ free(file_lowvals);
+ free(file_maxvals);
+ free(file_minvals);
  free(histogram);
  free(outbuffer);
  free(inbuffer);
  for (i = 0; i < num_input_files; i++)
    {
+     if (perfile_output_files[i] != output_files[i]) { free(perfile_output_files[i]); }
      free(output_files[i]);
      free(input_files[i]);
    }
+ free(perfile_output_files);
  free(output_files);
  free(input_files);
 
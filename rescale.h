@@ -23,6 +23,24 @@ const char *RESCALE_COPYRIGHT = "Copyright (c) 2016, 2017, 2019 University of So
 #define MAX_BUFFER 100000000000 /* the maximum allowable buffer size */
 #define DEFAULT_HISTOGRAM_BINS 65536 /* the number of histogram bins */
 #define THRESHOLD 0.002 /* values below this or above 1-this will be scaled out */
+#define JOURNAL_SUFFIX ".journal" /* appended to the first output name to name the journal */
+#define JOURNAL_COMMIT_BYTES 1073741824 /* bytes of input converted between journal commits */
+#define PERFILE_TAG ".perfile" /* marks per-file scaled outputs when both scalings are written */
+#define WATCH_EXTENSION ".vol" /* default extension of data files picked up in watch mode */
+#define WATCH_EVENT_BUFFER 65536 /* bytes of inotify events to read at once */
+
+/* scaling policies; these are bits so that both may be asked for */
+
+#define SCALE_GLOBAL 1 /* scale every file against the range across all of them */
+#define SCALE_PER_FILE 2 /* scale every file against its own range */
+#define SCALE_BOTH (SCALE_GLOBAL | SCALE_PER_FILE)
+#define SCALE_POLICY_NAME(p) ((p) == SCALE_BOTH ? "both" : (p) == SCALE_PER_FILE ? "file" : "global")
+
+/* journal format */
+
+#define JOURNAL_MAGIC "rescale-journal" /* first token of a journal file */
+#define JOURNAL_VERSION 2 /* bump this if the journal layout changes */
+#define JOURNAL_LINE 4096 /* longest journal line we are prepared to parse */
 
 /* constants */
 
@@ -34,6 +52,11 @@ const char *RESCALE_COPYRIGHT = "Copyright (c) 2016, 2017, 2019 University of So
 #define WINDOWS
 #endif
 
+/* watch mode needs inotify */
+#if defined(__linux__)
+#define INOTIFY
+#endif
+
 /* define a few error codes */
 
 #define OK 0
@@ -48,11 +71,81 @@ const char *RESCALE_COPYRIGHT = "Copyright (c) 2016, 2017, 2019 University of So
 #define ERR_BAD_THRESHOLD 9
 #define ERR_FAILED_TO_READ_A_VALUE_FROM_AN_OPEN_FILE 10
 #define ERR_FAILED_TO_OPEN_VGI_FILE 11
+#define ERR_JOURNAL_UNWRITABLE 12
+#define ERR_JOURNAL_UNREADABLE 13
+#define ERR_JOURNAL_DOES_NOT_MATCH_INPUTS 14
+#define ERR_FAILED_TO_WRITE_OUTPUT 15
+#define ERR_WATCH_FAILED 16
+
+/* journal of a conversion run; records the scaling parameters and how
+   many output elements of each file have been durably written, so that
+   a crashed run can be resumed without repeating the statistics passes */
+typedef struct
+{
+  char *filename; /* where the journal lives on disk */
+  float threshold; /* saturation threshold used to derive the scaling */
+  int nbins; /* number of histogram bins used to derive the scaling */
+  float lowval; /* low value for scaling */
+  float scalerange; /* range for scaling */
+  int policy; /* which scalings are being written */
+  int enabled; /* cleared if the journal could not be written, so we stop trying */
+  int num_files; /* number of input files */
+  char **input_files; /* names of input files */
+  int64_t *input_sizes; /* sizes of input files when the journal was started */
+  int64_t *input_mtimes; /* modification times of input files when the journal was started */
+  uint64_t *committed; /* number of output elements synced to disk, per file */
+  float *file_lowvals; /* low value for per-file scaling, per file */
+  float *file_scaleranges; /* range for per-file scaling, per file */
+} journal_t;
+
+/* a histogram folded together a block at a time as the data arrives,
+   without knowing the extents in advance; whenever a value lands
+   outside it the bins double in width, merging pairwise. In the 16-bit
+   build the bins are simply fixed over the whole value range */
+typedef struct
+{
+  uint64_t *bins; /* nbins+1 counts, the last one spare as elsewhere */
+  int nbins; /* number of histogram bins */
+  double origin; /* lower edge of the first bin */
+  double width; /* width of every bin */
+  int has_range; /* whether origin/width mean anything yet */
+  int stale; /* set once it no longer matches the data, which must then be binned again */
+} running_histogram_t;
+
+/* sets of histogram bins given back for reuse, so that watch mode does
+   not allocate fresh ones for every file of every volume */
+typedef struct
+{
+  uint64_t **bins; /* bins waiting to be reused */
+  int count; /* number of sets waiting */
+  int nbins; /* number of histogram bins in each set */
+} bin_pool_t;
+
+/* a data file seen in watch mode, whose extents and histogram are
+   folded in as it is written, while it is still warm in the page cache */
+typedef struct
+{
+  char *filename; /* path of the data file */
+  uint64_t folded; /* bytes folded into the extents so far */
+  raw_t minval; /* minimum of the values folded so far */
+  raw_t maxval; /* maximum of the values folded so far */
+  int has_values; /* whether minval/maxval mean anything yet */
+  running_histogram_t histogram; /* histogram of this file alone, for per-file scaling, while it is written */
+  int settled; /* whether lowval/scalerange have been worked out from it and its bins given back */
+  float lowval; /* low value for per-file scaling */
+  float scalerange; /* range for per-file scaling */
+} watch_file_t;
 
 /* function prototypes */
 
 int64_t get_filesize(const char *filename);
 
+int64_t get_filemtime(const char *filename);
+
+int sync_file(FILE *file);
+
+int seek_file(FILE *file, uint64_t offset);
+
 void info();
 
 void usage();
@@ -61,13 +154,71 @@ char* read_update_size_vgi(char *vgifile, int x, int y, int z);
 
 int read_first_value(char *filename, raw_t *target);
 
-uint64_t find_minmax_values(char *filename, raw_t *minval, raw_t *maxval, uint64_t total_size_read, uint64_t total_size_input, uint64_t bufcount, raw_t *buffer, time_t clk_split);
+uint64_t find_minmax_values(char *filename, raw_t *minval, raw_t *maxval, raw_t *file_minval, raw_t *file_maxval, uint64_t total_size_read, uint64_t total_size_input, uint64_t bufcount, raw_t *buffer, time_t clk_split);
+
+int histogram_bin(raw_t value, raw_t minval, float bin_factor, int nbins);
 
-uint64_t build_histogram(char *filename, uint64_t *histogram, raw_t minval, float bin_factor, uint64_t total_size_read, uint64_t total_size_input, uint64_t bufcount, raw_t *buffer, time_t clk_split);
+uint64_t build_histogram(char *filename, uint64_t *histogram, int nbins, raw_t minval, float bin_factor, uint64_t *file_histogram, raw_t file_minval, float file_bin_factor, raw_t *seen_minval, raw_t *seen_maxval, uint64_t total_size_read, uint64_t total_size_input, uint64_t bufcount, raw_t *buffer, time_t clk_split);
 
 uint64_t calculate_number_of_values(uint64_t *histogram, int nbins);
 
-void convert_data(char *input_file, char *output_file, raw_t *inbuffer, unsigned char *outbuffer, float lowval, float scalerange, uint64_t buffer_count, uint64_t *total_size_read,  uint64_t *total_size_written,  uint64_t total_size_input);
+void find_percentile_extents(uint64_t *histogram, int nbins, raw_t minval, raw_t maxval, float t_low, float t_high, raw_t *lowval, raw_t *highval);
+
+void scale_buffer(raw_t *inbuffer, unsigned char *outbuffer, size_t nelements, float lowval, float scalerange);
+
+FILE *open_output(char *output_file, uint64_t start);
+
+char *make_output_name(const char *input_file, const char *tag, const char *suffix);
+
+int convert_data(char *input_file, char *output_file, char *perfile_output_file, raw_t *inbuffer, unsigned char *outbuffer, float lowval, float scalerange, float perfile_lowval, float perfile_scalerange, uint64_t buffer_count, uint64_t *total_size_read,  uint64_t *total_size_written,  uint64_t total_size_input, raw_t *seen_minval, raw_t *seen_maxval, journal_t *journal, int file_index);
+
+int commit_journal(journal_t *journal, int file_index, uint64_t elements, FILE *outfile, FILE *perfile_outfile);
+
+int init_journal(journal_t *journal, const char *filename, int num_files);
+
+void free_journal(journal_t *journal);
+
+int write_journal(journal_t *journal);
+
+int read_journal(const char *filename, journal_t *journal);
+
+int check_journal(journal_t *journal, char **input_files, int num_input_files, float threshold, int nbins, int policy);
+
+int ends_with(const char *str, const char *suffix);
+
+void init_running_histogram(running_histogram_t *hist, uint64_t *bins, int nbins);
+
+void widen_running_histogram(running_histogram_t *hist, double value);
+
+void fold_into_histogram(running_histogram_t *hist, raw_t *buffer, size_t nelements);
+
+void running_percentile_extents(running_histogram_t *hist, float t_low, float t_high, float *lowval, float *scalerange);
+
+uint64_t *take_bins(bin_pool_t *pool);
+
+void give_back_bins(bin_pool_t *pool, uint64_t *bins);
+
+void settle_watch_file(watch_file_t *watch_file, bin_pool_t *pool, float threshold);
+
+void restart_watch_file(watch_file_t *watch_file, running_histogram_t *histogram);
+
+int fold_new_data(watch_file_t *watch_file, running_histogram_t *histogram, bin_pool_t *pool, raw_t *buffer, uint64_t bufcount, uint64_t min_bytes);
+
+int find_watch_file(watch_file_t *pending, int num_pending, const char *filename);
+
+void remove_watch_file(watch_file_t *pending, int *num_pending, int index, bin_pool_t *pool);
+
+int add_watch_file(watch_file_t **pending, int *num_pending, const char *filename);
+
+void rebin_watch_batch(watch_file_t *pending, int num_pending, float threshold, running_histogram_t *histogram, bin_pool_t *pool, uint64_t buffer_count, raw_t *inbuffer, time_t clk_split, float *lowval, float *scalerange);
+
+int convert_watch_batch(watch_file_t *pending, int num_pending, char *vgi_file, char *processed_suffix, int auto_flag, int policy, float threshold, running_histogram_t *histogram, bin_pool_t *pool, uint64_t buffer_count, raw_t *inbuffer, unsigned char *outbuffer, char **produced, int *num_produced);
+
+#ifdef INOTIFY
+void rescan_directory(char *watch_dir, char *watch_extension, char *processed_suffix, watch_file_t **pending, int *num_pending, time_t since);
+#endif
+
+int watch_directory(char *watch_dir, char *watch_extension, char *processed_suffix, int auto_flag, int policy, float threshold, int nbins, uint64_t *histogram, uint64_t buffer_count, raw_t *inbuffer, unsigned char *outbuffer);
 
 void strip_ext();
 #endif